@@ -0,0 +1,311 @@
+#include "pch.h"
+#include "nnetapi.h"
+#include <chrono>
+#include <fstream>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#if defined(__AVX2__) && (defined(__FMA__) || defined(_MSC_VER)) // gcc/clang can have AVX2 without FMA (-mavx2 without -mfma), MSVC's /arch:AVX2 always includes it
+#define NNET_AVX2_FMA
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/*
+ * Compute backends for nnet, plus the autotuner that picks between them.
+ * All three do the same three operations a layer needs (forward multiply, backward multiply, gradient accumulation),
+ * they just go about it differently:
+ *   arma  - plain armadillo operators, which hand the work off to whatever BLAS armadillo was linked against
+ *   simd  - hand written kernels working down the columns of the (column major) weight matrix, using AVX2/AVX-512 when compiled with them
+ *   omp_N - the simd kernels split across N OpenMP threads
+ * BLAS has a fair amount of call overhead for tiny matrices, and threads only pay off on the big ones, hence tuning per layer shape.
+ */
+
+using namespace std;
+using namespace arma;
+
+static void axpy(double* y, const double* x, double a, int n) // y += a * x
+{
+	int i = 0;
+#if defined(__AVX512F__)
+	__m512d av = _mm512_set1_pd(a);
+	for (; i + 8 <= n; i += 8)
+	{
+		_mm512_storeu_pd(y + i, _mm512_fmadd_pd(av, _mm512_loadu_pd(x + i), _mm512_loadu_pd(y + i)));
+	}
+#elif defined(NNET_AVX2_FMA)
+	__m256d av = _mm256_set1_pd(a);
+	for (; i + 4 <= n; i += 4)
+	{
+		_mm256_storeu_pd(y + i, _mm256_fmadd_pd(av, _mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i)));
+	}
+#endif
+	for (; i < n; i++) // leftovers, or everything if we weren't compiled with AVX2 + FMA
+	{
+		y[i] += a * x[i];
+	}
+}
+
+static double dot(const double* x, const double* y, int n)
+{
+	double result = 0.0;
+	int i = 0;
+#if defined(__AVX512F__)
+	__m512d sum = _mm512_setzero_pd();
+	for (; i + 8 <= n; i += 8)
+	{
+		sum = _mm512_fmadd_pd(_mm512_loadu_pd(x + i), _mm512_loadu_pd(y + i), sum);
+	}
+	result = _mm512_reduce_add_pd(sum);
+#elif defined(NNET_AVX2_FMA)
+	__m256d sum = _mm256_setzero_pd();
+	for (; i + 4 <= n; i += 4)
+	{
+		sum = _mm256_fmadd_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i), sum);
+	}
+	double lanes[4];
+	_mm256_storeu_pd(lanes, sum);
+	result = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+	for (; i < n; i++)
+	{
+		result += x[i] * y[i];
+	}
+	return result;
+}
+
+class arma_backend : public nnet_backend
+{
+	public:
+
+		string name() { return "arma"; }
+
+		void forward(const mat &weights, const vec &bias, const vec &in, vec &out)
+		{
+			out = weights * in;
+			out += bias;
+		}
+
+		void backward(const mat &weights, const vec &sigma, vec &out)
+		{
+			out = weights.t() * sigma;
+		}
+
+		void accumulate(mat &gradient, const vec &sigma, const vec &in)
+		{
+			gradient -= sigma * in.t();
+		}
+};
+
+class simd_backend : public nnet_backend
+{
+	public:
+
+		string name() { return "simd"; }
+
+		void forward(const mat &weights, const vec &bias, const vec &in, vec &out)
+		{
+			out = bias;
+			for (int k = 0; k < weights.n_cols; k++) // out += weights.col(k) * in(k), so we only ever walk down contiguous columns
+			{
+				axpy(out.memptr(), weights.colptr(k), in(k), weights.n_rows);
+			}
+		}
+
+		void backward(const mat &weights, const vec &sigma, vec &out)
+		{
+			out.set_size(weights.n_cols);
+			for (int k = 0; k < weights.n_cols; k++) // row k of weights.T is column k of weights
+			{
+				out(k) = dot(weights.colptr(k), sigma.memptr(), weights.n_rows);
+			}
+		}
+
+		void accumulate(mat &gradient, const vec &sigma, const vec &in)
+		{
+			for (int k = 0; k < gradient.n_cols; k++)
+			{
+				axpy(gradient.colptr(k), sigma.memptr(), -in(k), gradient.n_rows);
+			}
+		}
+};
+
+#ifdef _OPENMP
+class omp_backend : public nnet_backend
+{
+	int threads;
+
+	public:
+
+		omp_backend(int thread_count) : threads(thread_count) {}
+
+		string name() { return "omp_" + to_string(threads); }
+
+		void forward(const mat &weights, const vec &bias, const vec &in, vec &out)
+		{
+			out = bias;
+			int rows  = weights.n_rows;
+			int chunk = (rows + threads - 1) / threads; // each thread gets its own slice of rows, so nobody writes to the same part of out
+
+			#pragma omp parallel for num_threads(threads)
+			for (int t = 0; t < threads; t++)
+			{
+				int start = t * chunk;
+				int len	  = std::min(chunk, rows - start);
+				for (int k = 0; k < (int)weights.n_cols && len > 0; k++)
+				{
+					axpy(out.memptr() + start, weights.colptr(k) + start, in(k), len);
+				}
+			}
+		}
+
+		void backward(const mat &weights, const vec &sigma, vec &out)
+		{
+			out.set_size(weights.n_cols);
+
+			#pragma omp parallel for num_threads(threads)
+			for (int k = 0; k < (int)weights.n_cols; k++)
+			{
+				out(k) = dot(weights.colptr(k), sigma.memptr(), weights.n_rows);
+			}
+		}
+
+		void accumulate(mat &gradient, const vec &sigma, const vec &in)
+		{
+			#pragma omp parallel for num_threads(threads)
+			for (int k = 0; k < (int)gradient.n_cols; k++)
+			{
+				axpy(gradient.colptr(k), sigma.memptr(), -in(k), gradient.n_rows);
+			}
+		}
+};
+#endif
+
+nnet_backend* nnet_backend::create(string name)
+{
+	if (name == "arma") return new arma_backend();
+	if (name == "simd") return new simd_backend();
+#ifdef _OPENMP
+	if (name.compare(0, 4, "omp_") == 0)
+	{
+		int threads = atoi(name.c_str() + 4);
+		if (threads > 0 && threads <= omp_get_max_threads())
+		{
+			return new omp_backend(threads);
+		}
+	}
+#endif
+	return NULL;
+}
+
+void nnet_backend::get_candidates(vector<string> &names)
+{
+	names.clear();
+	names.push_back("arma");
+	names.push_back("simd");
+#ifdef _OPENMP
+	for (int t = 2; t <= omp_get_max_threads(); t *= 2) // powers of two are plenty, the timings don't change much in between
+	{
+		names.push_back("omp_" + to_string(t));
+	}
+#endif
+}
+
+string nnet_backend::tune(int rows, int cols)
+{
+	vector<string> names;
+	get_candidates(names);
+
+	mat weights  = randu<mat>(rows, cols);
+	mat gradient = zeros<mat>(rows, cols);
+	vec bias	 = randu<vec>(rows);
+	vec in		 = randu<vec>(cols);
+	vec out;
+	vec back;
+
+	// enough repetitions that each candidate runs for a millisecond or so, even on the small layers
+	int reps = std::max(20, 2000000 / std::max(1, rows * cols));
+
+	string best		 = "arma";
+	double best_time = -1.0;
+
+	for (int i = 0; i < names.size(); i++)
+	{
+		nnet_backend* backend = create(names[i]);
+		backend->forward(weights, bias, in, out); // warm up, so the first candidate doesn't pay for page faults and thread pool startup
+		backend->backward(weights, out, back);
+
+		auto start = chrono::high_resolution_clock::now();
+		for (int r = 0; r < reps; r++) // same mix of work as one training sample
+		{
+			backend->forward(weights, bias, in, out);
+			backend->backward(weights, out, back);
+			backend->accumulate(gradient, out, in);
+		}
+		double time = chrono::duration<double>(chrono::high_resolution_clock::now() - start).count();
+
+		if (best_time < 0.0 || time < best_time)
+		{
+			best_time = time;
+			best	  = names[i];
+		}
+		delete backend;
+	}
+
+	return best;
+}
+
+string nnet_backend::build_tag() // what the timings in a cache depend on, besides the layer shapes
+{
+#if defined(__AVX512F__)
+	string isa = "avx512";
+#elif defined(NNET_AVX2_FMA)
+	string isa = "avx2_fma";
+#else
+	string isa = "scalar";
+#endif
+#ifdef _OPENMP
+	int threads = omp_get_max_threads();
+#else
+	int threads = 1;
+#endif
+	return "isa=" + isa + " threads=" + to_string(threads);
+}
+
+int nnet_backend::load_cache(string path, vector<int> &rows, vector<int> &cols, vector<string> &names) // reads the build tag, then "rows cols backend" lines. Returns 0 if there's no cache, or it was tuned for a different build or machine
+{
+	ifstream cache(path);
+	if (!cache.is_open())
+	{
+		return 0;
+	}
+
+	string tag;
+	getline(cache, tag);
+	if (tag != build_tag())
+	{
+		printf("Backend cache was tuned for \"%s\", this is \"%s\", retuning\n", tag.c_str(), build_tag().c_str());
+		return 0;
+	}
+
+	int r, c;
+	string name;
+	while (cache >> r >> c >> name)
+	{
+		rows.push_back(r);
+		cols.push_back(c);
+		names.push_back(name);
+	}
+	return 1;
+}
+
+void nnet_backend::save_cache(string path, vector<int> &rows, vector<int> &cols, vector<string> &names)
+{
+	ofstream cache(path);
+	cache << build_tag() << "\n";
+	for (int i = 0; i < names.size(); i++)
+	{
+		cache << rows[i] << " " << cols[i] << " " << names[i] << "\n";
+	}
+}
@@ -6,6 +6,7 @@
 //#include <fstream>
 #include <armadillo>
 #include <string.h>
+#include <vector>
 
 using namespace std;
 using namespace arma;
@@ -34,4 +35,33 @@ class nnet_io
 		static void get_save_dir(string &save_dir);
 };
 
+// Compute backend for the matrix math in the forward and backward passes. Each layer of the net gets its own backend,
+// since the fastest way to multiply a 784x16 matrix isn't necessarily the fastest way to multiply a 16x16 one
+class nnet_backend
+{
+	public:
+
+		virtual ~nnet_backend() {}
+
+		virtual string name() = 0;
+
+		virtual void forward(const mat &weights, const vec &bias, const vec &in, vec &out) = 0; // out = weights * in + bias
+
+		virtual void backward(const mat &weights, const vec &sigma, vec &out) = 0;				// out = weights.T * sigma
+
+		virtual void accumulate(mat &gradient, const vec &sigma, const vec &in) = 0;			// gradient -= sigma * in.T
+
+		static nnet_backend* create(string name); // returns NULL if the backend doesn't exist or isn't compiled in
+
+		static void get_candidates(vector<string> &names);
+
+		static string tune(int rows, int cols); // times every candidate on a layer of this shape and returns the name of the fastest
+
+		static string build_tag(); // compiled kernels and thread count, a cache tuned under a different tag is ignored
+
+		static int load_cache(string path, vector<int> &rows, vector<int> &cols, vector<string> &names);
+
+		static void save_cache(string path, vector<int> &rows, vector<int> &cols, vector<string> &names);
+};
+
 #endif
\ No newline at end of file